@@ -19,5 +19,10 @@ void audio_begin_capture();
 void audio_end_capture();
 
 
+// Set how many samples to look back on begin and ahead on end, to cover the
+// device's input latency. Defaults to SAMPLE_QUEUE_LATENCY.
+void audio_set_latency_pad(size_t pad);
+
+
 // Returns whether or not we are currently capturing audio
 bool audio_is_capturing();
@@ -11,3 +11,61 @@ constexpr size_t SAMPLE_QUEUE_NOT_LISTENING_MAX_SIZE = 10 * SAMPLE_RATE * CHANNE
 constexpr size_t SAMPLE_QUEUE_SHRINK_TO = 5 * SAMPLE_RATE * CHANNELS;
 
 constexpr size_t SAMPLE_QUEUE_LATENCY = static_cast<size_t>(0.2 * SAMPLE_RATE * CHANNELS);
+
+// Buffer sizes the tuner may pick from, smallest first. BUFFER_SIZE is where
+// it starts.
+constexpr int TUNER_BUFFER_SIZES[] = {256, 512, 1024, 1536, 2048, 4096};
+
+// Callbacks to ignore after opening the device, then callbacks to measure
+// before deciding whether the current buffer size is stable.
+constexpr int TUNER_WARMUP_CALLBACKS = 16;
+constexpr int TUNER_WINDOW_CALLBACKS = 128;
+
+// A buffer size is stable if no callback interval exceeds this multiple of
+// the buffer period, and the interval standard deviation stays under this
+// fraction of it.
+constexpr double TUNER_MAX_INTERVAL_RATIO = 1.75;
+constexpr double TUNER_MAX_JITTER_RATIO = 0.25;
+
+// Unstable windows in a row before stepping the buffer size up, so a single
+// late callback (a disk sync, another device opening) doesn't count.
+constexpr int TUNER_UNSTABLE_WINDOWS = 3;
+
+// Stable windows in a row before probing a smaller size again.
+constexpr int TUNER_REPROBE_WINDOWS = 64;
+
+// Extra headroom on top of measured latency, period and jitter.
+constexpr double TUNER_PAD_MARGIN_SECONDS = 0.02;
+
+// The click must reach this level, and this many times the noise peak heard
+// before it.
+constexpr int16_t CALIBRATION_CLICK_THRESHOLD = 8192;
+constexpr int CALIBRATION_NOISE_RATIO = 4;
+// The click is a short tone burst, well inside what speakers, mics and
+// resamplers pass through.
+constexpr double CALIBRATION_CLICK_HZ = 2000.0;
+constexpr double CALIBRATION_CLICK_SECONDS = 0.005;
+constexpr double CALIBRATION_TIMEOUT_SECONDS = 1.0;
+
+// Where captures are written. Must exist.
+constexpr const char * CAPTURE_DIRECTORY = "captures";
+
+// Capture output. Data is handed to the kernel in chunks of up to this many
+// bytes per iovec.
+constexpr size_t OUTPUT_WRITE_CHUNK_BYTES = 1 << 20;
+
+// Captures written within this long of each other are committed together.
+// On Linux a batch costs one syncfs plus one directory fsync however many
+// captures it holds; elsewhere each capture's data gets its own fsync.
+constexpr int OUTPUT_SYNC_WINDOW_MS = 500;
+
+// A failed capture is retried with linear backoff, then dropped with an error.
+constexpr int OUTPUT_MAX_ATTEMPTS = 4;
+constexpr int OUTPUT_RETRY_BACKOFF_MS = 500;
+
+// Capture browser, drawn below the live waveform.
+constexpr int BROWSER_ROWS = 4;
+constexpr int BROWSER_ROW_HEIGHT = 12;
+constexpr int BROWSER_WAVEFORM_HEIGHT = 40;
+constexpr int BROWSER_HEIGHT = BROWSER_ROWS * BROWSER_ROW_HEIGHT + BROWSER_WAVEFORM_HEIGHT;
+constexpr size_t BROWSER_MAX_CLIPS = 20;
@@ -0,0 +1,46 @@
+#pragma once
+
+// durable_write.h
+//
+// Crash-safe .wav output. A capture is written to a temp file next to its
+// final path, then a batch of them is synced together and renamed into
+// place, so a file either appears complete under its real name or not at
+// all. POSIX only.
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+// A capture sitting in its temp file, written but not yet synced.
+struct DurableWrite {
+    int fd;
+    std::string temp_filename;
+    std::string filename;
+
+    // Set by commit once the file is under its real name.
+    bool renamed;
+};
+
+// Preallocates and writes the whole .wav to a temp file. On failure returns
+// nullopt with `error` set, and leaves nothing behind.
+std::optional<DurableWrite> durable_write_begin(
+    const int16_t * samples, size_t sample_count, int sample_rate,
+    const std::string & filename, std::string & error);
+
+// Syncs every write in the batch, then renames each into place. On Linux
+// the whole batch shares one syncfs for its data and one fsync for its
+// directory; elsewhere each file's data is synced on its own. Returns one
+// entry per write: empty on success, else the error. All temp files are
+// closed afterwards, and failed ones removed. A write that failed with
+// `renamed` set has its data synced under its real name, and only needs
+// durable_write_sync_directory.
+std::vector<std::string> durable_write_commit(std::vector<DurableWrite> & batch);
+
+// Syncs the directory holding `filename`, making its rename durable. On
+// failure returns false with `error` set.
+bool durable_write_sync_directory(const std::string & filename, std::string & error);
+
+// Removes temp files in `directory` left behind by a crash before commit.
+void durable_write_remove_stale(const std::string & directory);
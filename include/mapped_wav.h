@@ -0,0 +1,36 @@
+#pragma once
+
+// mapped_wav.h
+//
+// Read-only memory mapping of a .wav as written by durable_write. Samples are
+// read straight out of the mapping, with no copy or decode. POSIX only.
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct MappedWav {
+    void * mapping;
+    size_t mapping_size;
+
+    // Point into the mapping. Little-endian 16-bit mono PCM.
+    const int16_t * samples;
+    size_t sample_count;
+    int sample_rate;
+};
+
+// Min and max sample over one column of a waveform display.
+struct WavPeak {
+    int16_t min;
+    int16_t max;
+};
+
+// Maps the file. On failure returns nullopt with `error` set.
+std::optional<MappedWav> mapped_wav_open(const std::string & filename, std::string & error);
+
+void mapped_wav_close(MappedWav & wav);
+
+// One pass over the mapping, reduced to `columns` peaks.
+std::vector<WavPeak> mapped_wav_peaks(const MappedWav & wav, int columns);
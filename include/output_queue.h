@@ -2,8 +2,22 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <string>
+#include <vector>
 
 // thread safe
 void output_queue_push(int16_t * samples, size_t sample_count, int sample_rate);
 
-void output_queue_start_thread();
\ No newline at end of file
+void output_queue_start_thread();
+
+// Writes and syncs everything still queued, without waiting out the sync
+// window or retry backoff, then stops the output thread. Call before exit.
+void output_queue_stop();
+
+// thread safe. Filenames of captures that have been durably written since the
+// last call, oldest first.
+std::vector<std::string> output_queue_take_finished();
+
+// thread safe. Filenames of captures that could not be written and have been
+// given up on since the last call, oldest first.
+std::vector<std::string> output_queue_take_failed();
\ No newline at end of file
@@ -0,0 +1,47 @@
+#pragma once
+
+// tuner.h
+//
+// The tuner watches the timing of capture callbacks to find the smallest
+// buffer size the device delivers stably, and measures input latency with a
+// loopback click so the capture pad can be shrunk to just cover it.
+
+#include <cstdint>
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+// Called from the main thread whenever the capture device is (re)opened,
+// with the buffer size and sample rate the device actually gave us.
+void tuner_device_opened(int buffer_size, int sample_rate);
+
+// Called from the audio thread at the start of every callback. `now` is a
+// monotonic timestamp in seconds.
+void tuner_callback_tick(double now, const int16_t * samples, size_t sample_count);
+
+// Buffer size to ask for the next time the capture device is opened.
+int tuner_buffer_size();
+
+// Returns true (once) if the tuner wants the capture device reopened with
+// tuner_buffer_size().
+bool tuner_take_reopen_request();
+
+// Start a loopback click test on the live device. Call just before the click
+// is queued for playback; the latency is measured to its arrival in the
+// captured input.
+void tuner_begin_calibration();
+
+bool tuner_is_calibrating();
+
+// Run the click test against a recording that starts at the moment the click
+// was played, standing in for the live device. Returns the latency in
+// seconds, or nullopt if no click was found.
+std::optional<double> tuner_calibrate_from_recording(const std::vector<int16_t> & samples, int sample_rate);
+
+// The most recent successful calibration, in seconds.
+std::optional<double> tuner_measured_latency();
+
+// Pre/post-roll pad, in samples at the rate the capture device actually
+// opened with, that covers the measured latency plus callback jitter.
+// SAMPLE_QUEUE_LATENCY until calibrated.
+size_t tuner_latency_pad();
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #pragma pack(push, 1)
 struct WAVHeader {
@@ -21,4 +22,16 @@ struct WAVHeader {
 };
 #pragma pack(pop)
 
-bool write_wav(int16_t *samples, size_t sample_count, int sample_rate, const std::string &filename);
\ No newline at end of file
+// Fills in a header for 16-bit mono PCM.
+void fill_wav_header(WAVHeader &header, size_t sample_count, int sample_rate);
+
+// True for a canonical header with the data chunk straight after fmt, in the
+// format everything here reads and writes.
+bool wav_header_is_pcm16_mono(const WAVHeader &header);
+
+// "<what> <filename>: <strerror(errno)>", for reporting failed file calls.
+std::string errno_string(const std::string &what, const std::string &filename);
+
+// Reads a 16-bit mono PCM file with a canonical 44-byte header, as written by
+// durable_write. Returns false if the file can't be read or isn't in that format.
+bool read_wav(const std::string &filename, std::vector<int16_t> &samples, int &sample_rate);
\ No newline at end of file
@@ -41,6 +41,11 @@ std::vector<int16_t> sample_queue;
 std::optional<size_t> capture_start_idx = std::nullopt;
 std::optional<size_t> capture_end_idx = std::nullopt;
 
+// How far to look back on start and forward on end, in samples. Starts at
+// SAMPLE_QUEUE_LATENCY and is narrowed by the tuner once it has measured the
+// device.
+size_t latency_pad = SAMPLE_QUEUE_LATENCY;
+
 
 // DOES NOT ACQUIRE THE LOCK!!! Do it from the caller!
 void nolock_maybe_shrink() {
@@ -88,8 +93,8 @@ void audio_begin_capture() {
         std::cout << "Capture RESTARTS from " << capture_start_idx.value() << std::endl;
     }
     else {
-        capture_start_idx = (SAMPLE_QUEUE_LATENCY > sample_queue.size() ? 
-            0 : sample_queue.size() - SAMPLE_QUEUE_LATENCY);
+        capture_start_idx = (latency_pad > sample_queue.size() ? 
+            0 : sample_queue.size() - latency_pad);
         std::cout << "Capture starts at " << capture_start_idx.value() << std::endl;
     }
     
@@ -104,7 +109,14 @@ void audio_end_capture() {
         return;
     }
 
-    capture_end_idx = sample_queue.size() + SAMPLE_QUEUE_LATENCY;
+    capture_end_idx = sample_queue.size() + latency_pad;
+}
+
+// Takes effect from the next begin/end request; a capture already in
+// progress keeps the indices it was given.
+void audio_set_latency_pad(size_t pad) {
+    std::lock_guard<std::mutex> lock(audioproc_mutex);
+    latency_pad = pad;
 }
 
 bool audio_is_capturing() {
@@ -0,0 +1,251 @@
+#include "durable_write.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <iostream>
+#include <set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "wavfile.h"
+
+std::string parent_directory(const std::string & filename) {
+    size_t slash = filename.find_last_of('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    return slash == 0 ? "/" : filename.substr(0, slash);
+}
+
+// Reserve the blocks up front so the file can't run out of space halfway
+// through and is laid out contiguously. Best effort where unsupported.
+bool preallocate(int fd, off_t length) {
+#if defined(__linux__)
+    if (fallocate(fd, 0, 0, length) != 0) {
+        return errno == EOPNOTSUPP || errno == ENOSYS;
+    }
+#elif defined(__APPLE__)
+    fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, length, 0};
+    if (fcntl(fd, F_PREALLOCATE, &store) != 0) {
+        store.fst_flags = F_ALLOCATEALL;
+        fcntl(fd, F_PREALLOCATE, &store);
+    }
+#endif
+    (void)fd;
+    (void)length;
+    return true;
+}
+
+// Writes all of `iov` at offset 0, coping with short writes.
+bool write_all(int fd, std::vector<iovec> & iov) {
+    size_t first = 0;
+    off_t offset = 0;
+
+    while (first < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+        ssize_t written = pwritev(fd, iov.data() + first, count, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += written;
+
+        // Skip past whatever was fully written, trim what was partly written.
+        size_t remaining = static_cast<size_t>(written);
+        while (first < iov.size() && remaining >= iov[first].iov_len) {
+            remaining -= iov[first].iov_len;
+            first++;
+        }
+        if (remaining > 0) {
+            iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + remaining;
+            iov[first].iov_len -= remaining;
+        }
+    }
+    return true;
+}
+
+#if !defined(__linux__)
+// Flush one file's data to stable storage.
+bool sync_file(int fd) {
+#if defined(__APPLE__)
+    // Plain fsync on macOS stops at the drive's cache.
+    if (fcntl(fd, F_FULLFSYNC) == 0) {
+        return true;
+    }
+#endif
+    return fsync(fd) == 0;
+}
+#endif
+
+// Makes the renames in `directory` durable.
+bool sync_directory(const std::string & directory) {
+    int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return ok;
+}
+
+// Marks every write in `directory` that hasn't failed yet with `error`.
+void fail_directory(std::vector<DurableWrite> & batch, std::vector<std::string> & errors,
+    const std::string & directory, const std::string & error
+) {
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (errors[i].empty() && parent_directory(batch[i].filename) == directory) {
+            errors[i] = error;
+        }
+    }
+}
+
+const std::string TEMP_SUFFIX = ".tmp";
+
+std::optional<DurableWrite> durable_write_begin(
+    const int16_t * samples, size_t sample_count, int sample_rate,
+    const std::string & filename, std::string & error
+) {
+    WAVHeader header;
+    fill_wav_header(header, sample_count, sample_rate);
+
+    DurableWrite write;
+    write.filename = filename;
+    write.temp_filename = filename + TEMP_SUFFIX;
+    write.renamed = false;
+    write.fd = open(write.temp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (write.fd < 0) {
+        error = errno_string("Unable to open", write.temp_filename);
+        return std::nullopt;
+    }
+
+    size_t data_bytes = sample_count * sizeof(int16_t);
+    std::vector<iovec> iov;
+    iov.push_back(iovec{&header, sizeof(WAVHeader)});
+    const char * data = reinterpret_cast<const char *>(samples);
+    for (size_t offset = 0; offset < data_bytes; offset += OUTPUT_WRITE_CHUNK_BYTES) {
+        size_t length = std::min(OUTPUT_WRITE_CHUNK_BYTES, data_bytes - offset);
+        iov.push_back(iovec{const_cast<char *>(data + offset), length});
+    }
+
+    if (!preallocate(write.fd, sizeof(WAVHeader) + data_bytes)) {
+        error = errno_string("Unable to preallocate", write.temp_filename);
+    } else if (!write_all(write.fd, iov)) {
+        error = errno_string("Unable to write", write.temp_filename);
+    } else {
+        return write;
+    }
+
+    close(write.fd);
+    unlink(write.temp_filename.c_str());
+    return std::nullopt;
+}
+
+std::vector<std::string> durable_write_commit(std::vector<DurableWrite> & batch) {
+    std::vector<std::string> errors(batch.size());
+    if (batch.empty()) {
+        return errors;
+    }
+
+#if defined(__linux__)
+    // Start writeback on every file, then wait for all of it with a single
+    // syncfs per directory (in practice one for the whole batch) instead of
+    // a journal commit and cache flush per file. syncfs reports writeback
+    // errors since Linux 5.8.
+    std::set<std::string> data_directories;
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (sync_file_range(batch[i].fd, 0, 0, SYNC_FILE_RANGE_WRITE) != 0) {
+            errors[i] = errno_string("Unable to start writeback of", batch[i].temp_filename);
+        } else {
+            data_directories.insert(parent_directory(batch[i].filename));
+        }
+    }
+
+    for (const std::string & directory : data_directories) {
+        int fd = open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || syncfs(fd) != 0) {
+            fail_directory(batch, errors, directory, errno_string("Unable to sync filesystem of", directory));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+#else
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (!sync_file(batch[i].fd)) {
+            errors[i] = errno_string("Unable to sync", batch[i].temp_filename);
+        }
+    }
+#endif
+
+    std::set<std::string> directories;
+    for (size_t i = 0; i < batch.size(); i++) {
+        DurableWrite & write = batch[i];
+
+        if (close(write.fd) != 0 && errors[i].empty()) {
+            errors[i] = errno_string("Unable to close", write.temp_filename);
+        }
+        write.fd = -1;
+
+        if (errors[i].empty()) {
+            if (rename(write.temp_filename.c_str(), write.filename.c_str()) == 0) {
+                write.renamed = true;
+            } else {
+                errors[i] = errno_string("Unable to rename", write.temp_filename);
+            }
+        }
+
+        if (errors[i].empty()) {
+            directories.insert(parent_directory(write.filename));
+        } else {
+            unlink(write.temp_filename.c_str());
+        }
+    }
+
+    // The renames themselves aren't durable until their directory is synced.
+    // A failure here leaves `renamed` set: the data is safe, only the entry
+    // needs another sync.
+    for (const std::string & directory : directories) {
+        if (!sync_directory(directory)) {
+            fail_directory(batch, errors, directory, errno_string("Unable to sync directory", directory));
+        }
+    }
+
+    return errors;
+}
+
+bool durable_write_sync_directory(const std::string & filename, std::string & error) {
+    std::string directory = parent_directory(filename);
+    if (!sync_directory(directory)) {
+        error = errno_string("Unable to sync directory", directory);
+        return false;
+    }
+    return true;
+}
+
+void durable_write_remove_stale(const std::string & directory) {
+    DIR * dir = opendir(directory.c_str());
+    if (!dir) {
+        return;
+    }
+
+    while (struct dirent * entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.size() > TEMP_SUFFIX.size()
+            && name.compare(name.size() - TEMP_SUFFIX.size(), TEMP_SUFFIX.size(), TEMP_SUFFIX) == 0
+        ) {
+            std::string path = directory + "/" + name;
+            std::cout << "Removing stale " << path << std::endl;
+            unlink(path.c_str());
+        }
+    }
+    closedir(dir);
+}
\ No newline at end of file
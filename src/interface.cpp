@@ -3,7 +3,10 @@
 
     This source wraps SDL2 and any other needed low-level APIs for window,
     input, graphics, and audio access. Global variables store state, so
-    access from multiple threads must be externally synchronized.
+    access from multiple threads must be externally synchronized. The
+    exceptions are display_waveform and needs_redraw, which the audio
+    callback writes from SDL's audio thread, and the clip playback position,
+    which the playback callback advances.
 
 */
 
@@ -19,7 +22,9 @@
 #include <atomic>
 #include <optional>
 #include <array>
+#include <deque>
 #include <cmath>
+#include <cstring>
 
 #include <SDL.h>
 #include <SDL_ttf.h>
@@ -27,26 +32,57 @@
 #include "config.h"
 #include "interface.h"
 #include "audioproc.h"
+#include "tuner.h"
+#include "output_queue.h"
+#include "mapped_wav.h"
 
 SDL_Window *window = nullptr;
 SDL_Surface *screen_surface = nullptr;
 bool quit_requested = false;
-bool needs_redraw = true;
+std::atomic<bool> needs_redraw(true);
 
 int window_width = WINDOW_WIDTH;
-int window_height = WINDOW_HEIGHT;
+int window_height = WINDOW_HEIGHT + BROWSER_HEIGHT;
 
 SDL_AudioDeviceID audio_device = 0;
 std::string audio_device_name;
 SDL_AudioSpec audio_spec = {0};
 std::atomic<bool> is_capturing_audio(false);
 
+// Opened on demand to play the calibration click.
+SDL_AudioDeviceID playback_device = 0;
+
 TTF_Font * status_font = nullptr;
 
 int frame_count = 0;
 
+// Written by the audio callback, read by the renderer.
+std::mutex display_waveform_mutex;
 std::array<int8_t, WINDOW_WIDTH> display_waveform;
 
+// Recent captures, newest first. Each stays mapped while it's in the list,
+// and its peaks are computed once when it's added.
+struct BrowserClip {
+    std::string filename;
+    MappedWav wav;
+    std::vector<WavPeak> peaks;
+};
+
+std::deque<BrowserClip> browser_clips;
+size_t browser_selected = 0;
+
+// Set when the output queue gives up on a capture, and shown in the status
+// line until the next capture is saved.
+std::optional<std::string> capture_error;
+
+// Clip playback streams straight from the clip's mapping. clip_playing is
+// only changed while clip_device is closed; the callback just advances the
+// position.
+SDL_AudioDeviceID clip_device = 0;
+const BrowserClip * clip_playing = nullptr;
+std::atomic<size_t> clip_playback_position(0);
+std::atomic<bool> clip_playback_done(false);
+
 std::vector<std::string> preferred_audio_devices {
     "USB Advanced Audio Device",
     "MacBook Air Microphone"
@@ -76,6 +112,10 @@ std::optional<std::string> find_capture_device() {
 }
 
 void audioCallback(void *userdata, Uint8 *stream, int len) {
+
+    // Let the tuner time this callback before we spend any time in it.
+    double now = (double)SDL_GetPerformanceCounter() / SDL_GetPerformanceFrequency();
+    tuner_callback_tick(now, (int16_t *)stream, len / sizeof(int16_t));
     
     // Copy audio data into audioproc's sample queue.
     audio_samples_acquired((int16_t *)stream, len / sizeof(int16_t));
@@ -84,6 +124,7 @@ void audioCallback(void *userdata, Uint8 *stream, int len) {
     int16_t * audio_data = (int16_t *)stream;
     int num_samples = len / sizeof(int16_t);
 
+    std::lock_guard<std::mutex> lock(display_waveform_mutex);
     for (int i = 0; i < WINDOW_WIDTH; i++) {
         int j = i * num_samples / WINDOW_WIDTH;
         j = std::min(j, num_samples - 1);
@@ -105,7 +146,7 @@ void interface_audio_init() {
     desired.freq = SAMPLE_RATE;
     desired.format = AUDIO_S16SYS;
     desired.channels = CHANNELS;
-    desired.samples = BUFFER_SIZE;
+    desired.samples = tuner_buffer_size();
     desired.callback = audioCallback;
 
     std::optional<std::string> device_name = find_capture_device();
@@ -137,11 +178,54 @@ void interface_audio_init() {
     std::cout << "Audio channels: " << (int)audio_spec.channels << std::endl;
     std::cout << "Audio samples: " << audio_spec.samples << std::endl;
 
+    tuner_device_opened(audio_spec.samples, audio_spec.freq);
+
     is_capturing_audio = true;
     SDL_PauseAudioDevice(audio_device, 0);
 }
 
+// Plays a short click on the default output and starts the tuner's loopback
+// latency measurement. The capture device needs to hear the output, e.g.
+// through a loopback cable or a speaker next to the mic.
+void interface_audio_calibrate() {
+    if (!is_capturing_audio || tuner_is_calibrating()) {
+        return;
+    }
+
+    if (playback_device == 0) {
+        SDL_AudioSpec desired;
+        SDL_zero(desired);
+        desired.freq = audio_spec.freq;
+        desired.format = AUDIO_S16SYS;
+        desired.channels = 1;
+        desired.samples = 256;
+        desired.callback = nullptr;
+
+        SDL_AudioSpec obtained;
+        playback_device = SDL_OpenAudioDevice(nullptr, SDL_FALSE, &desired, &obtained, 0);
+        if (playback_device == 0) {
+            std::cerr << "Unable to open playback device for calibration: " << SDL_GetError() << std::endl;
+            return;
+        }
+        SDL_PauseAudioDevice(playback_device, 0);
+    }
+
+    std::vector<int16_t> click(static_cast<size_t>(CALIBRATION_CLICK_SECONDS * audio_spec.freq));
+    for (size_t i = 0; i < click.size(); i++) {
+        click[i] = (int16_t)(30000 * std::sin(2.0 * M_PI * CALIBRATION_CLICK_HZ * i / audio_spec.freq));
+    }
+
+    tuner_begin_calibration();
+    SDL_ClearQueuedAudio(playback_device);
+    SDL_QueueAudio(playback_device, click.data(), click.size() * sizeof(int16_t));
+}
+
 void interface_audio_teardown() {
+    if (playback_device != 0) {
+        SDL_CloseAudioDevice(playback_device);
+        playback_device = 0;
+    }
+
     if (!is_capturing_audio) {
         return;
     }
@@ -151,6 +235,93 @@ void interface_audio_teardown() {
     audio_device = 0;
 }
 
+void clipPlaybackCallback(void *userdata, Uint8 *stream, int len) {
+    const MappedWav * wav = (const MappedWav *)userdata;
+
+    size_t wanted = len / sizeof(int16_t);
+    size_t position = clip_playback_position;
+
+    // Only report done a callback after the last samples went out, so
+    // closing the device doesn't cut off the tail.
+    if (position >= wav->sample_count) {
+        clip_playback_done = true;
+    }
+
+    size_t count = std::min(wanted, wav->sample_count - std::min(position, wav->sample_count));
+    memcpy(stream, wav->samples + position, count * sizeof(int16_t));
+    memset(stream + count * sizeof(int16_t), 0, (wanted - count) * sizeof(int16_t));
+
+    clip_playback_position = position + count;
+    needs_redraw = true;
+}
+
+void interface_clip_stop() {
+    if (clip_device != 0) {
+        SDL_CloseAudioDevice(clip_device);
+        clip_device = 0;
+    }
+    clip_playing = nullptr;
+    needs_redraw = true;
+}
+
+void interface_clip_play(const BrowserClip & clip) {
+    interface_clip_stop();
+
+    SDL_AudioSpec desired;
+    SDL_zero(desired);
+    desired.freq = clip.wav.sample_rate;
+    desired.format = AUDIO_S16LSB;  // .wav byte order; SDL converts if the device differs
+    desired.channels = 1;
+    desired.samples = 1024;
+    desired.callback = clipPlaybackCallback;
+    desired.userdata = (void *)&clip.wav;
+
+    clip_playback_position = 0;
+    clip_playback_done = false;
+
+    SDL_AudioSpec obtained;
+    clip_device = SDL_OpenAudioDevice(nullptr, SDL_FALSE, &desired, &obtained, 0);
+    if (clip_device == 0) {
+        std::cerr << "Unable to open playback device: " << SDL_GetError() << std::endl;
+        return;
+    }
+
+    clip_playing = &clip;
+    SDL_PauseAudioDevice(clip_device, 0);
+}
+
+// Called when the output queue reports a capture safely on disk.
+void interface_browser_add(const std::string & filename) {
+    std::string error;
+    std::optional<MappedWav> wav = mapped_wav_open(filename, error);
+    if (!wav) {
+        std::cerr << "Error: " << error << std::endl;
+        return;
+    }
+
+    browser_clips.push_front(BrowserClip{filename, *wav, mapped_wav_peaks(*wav, WINDOW_WIDTH)});
+    browser_selected = 0;
+
+    while (browser_clips.size() > BROWSER_MAX_CLIPS) {
+        if (clip_playing == &browser_clips.back()) {
+            interface_clip_stop();
+        }
+        mapped_wav_close(browser_clips.back().wav);
+        browser_clips.pop_back();
+    }
+
+    needs_redraw = true;
+}
+
+void interface_browser_teardown() {
+    interface_clip_stop();
+    for (auto & clip : browser_clips) {
+        mapped_wav_close(clip.wav);
+    }
+    browser_clips.clear();
+    browser_selected = 0;
+}
+
 void interface_setup() {
 
     // Initialize SDL2
@@ -184,8 +355,8 @@ void interface_setup() {
         "Lastest Stop",
         SDL_WINDOWPOS_CENTERED,
         SDL_WINDOWPOS_CENTERED,
-        WINDOW_WIDTH,
-        WINDOW_HEIGHT,
+        window_width,
+        window_height,
         SDL_WINDOW_SHOWN
     );
 
@@ -208,6 +379,7 @@ void interface_setup() {
 }
 
 void interface_teardown() {
+    interface_browser_teardown();
     interface_audio_teardown();
 
     TTF_CloseFont(status_font);
@@ -239,9 +411,33 @@ void interface_process_events() {
                     needs_redraw = true;
                 }
 
+                if (event.key.keysym.sym == SDLK_c) {
+                    interface_audio_calibrate();
+                    needs_redraw = true;
+                }
+
                 if (event.key.keysym.sym == SDLK_SPACE) {
                     audio_begin_capture();
                 }
+
+                if (event.key.keysym.sym == SDLK_UP && browser_selected > 0) {
+                    browser_selected--;
+                    needs_redraw = true;
+                }
+
+                if (event.key.keysym.sym == SDLK_DOWN && browser_selected + 1 < browser_clips.size()) {
+                    browser_selected++;
+                    needs_redraw = true;
+                }
+
+                if (event.key.keysym.sym == SDLK_RETURN && !browser_clips.empty()) {
+                    const BrowserClip & clip = browser_clips[browser_selected];
+                    if (clip_playing == &clip) {
+                        interface_clip_stop();
+                    } else {
+                        interface_clip_play(clip);
+                    }
+                }
                 break;
 
             case SDL_KEYUP:
@@ -269,6 +465,35 @@ void interface_process_events() {
                 break;
         }
     }
+
+    // Apply the tuner's decisions. Reopening drops whatever the device had
+    // buffered, so never do it in the middle of a capture.
+    if (is_capturing_audio && !audio_is_capturing() && tuner_take_reopen_request()) {
+        interface_audio_teardown();
+        try {
+            interface_audio_init();
+        } catch (const std::runtime_error & e) {
+            // Same as the device going away: show disconnected, and pick it
+            // back up on the next SDL_AUDIODEVICEADDED or 'r'.
+            std::cerr << "Unable to reopen audio device: " << e.what() << std::endl;
+        }
+        needs_redraw = true;
+    }
+    audio_set_latency_pad(tuner_latency_pad());
+
+    for (const std::string & filename : output_queue_take_finished()) {
+        interface_browser_add(filename);
+        capture_error = std::nullopt;
+    }
+
+    for (const std::string & filename : output_queue_take_failed()) {
+        capture_error = "Failed to save " + filename.substr(filename.find_last_of('/') + 1);
+        needs_redraw = true;
+    }
+
+    if (clip_playing && clip_playback_done) {
+        interface_clip_stop();
+    }
 }
 
 void interface_draw_string(const std::string & str, int x, int y, uint8_t r, uint8_t g, uint8_t b) {
@@ -287,11 +512,17 @@ void interface_draw_string(const std::string & str, int x, int y, uint8_t r, uin
 }
 
 void interface_render_waveform() {
+    std::array<int8_t, WINDOW_WIDTH> waveform;
+    {
+        std::lock_guard<std::mutex> lock(display_waveform_mutex);
+        waveform = display_waveform;
+    }
+
     // Lock pixels for surface and manually draw waveform.
     SDL_LockSurface(screen_surface);
     for (int x = 0; x < WINDOW_WIDTH; x++) {
 
-        int y = 28 + display_waveform[x];
+        int y = 28 + waveform[x];
         y = std::clamp(y, 0, WINDOW_HEIGHT - 1);
 
         uint32_t * pixel = (uint32_t *)screen_surface->pixels + y * screen_surface->pitch / 4 + x;
@@ -325,6 +556,59 @@ void interface_render_waveform() {
     SDL_UnlockSurface(screen_surface);
 }
 
+void interface_render_browser() {
+    int top = WINDOW_HEIGHT;
+
+    SDL_Rect area = {0, top, WINDOW_WIDTH, BROWSER_HEIGHT};
+    SDL_FillRect(screen_surface, &area, SDL_MapRGB(screen_surface->format, 245, 240, 242));
+
+    if (browser_clips.empty()) {
+        interface_draw_string("No captures yet.", 5, top + 2, 120, 110, 116);
+        return;
+    }
+
+    // Scroll just enough to keep the selection in view.
+    size_t first = browser_selected >= BROWSER_ROWS ? browser_selected - BROWSER_ROWS + 1 : 0;
+
+    for (size_t row = 0; row < BROWSER_ROWS && first + row < browser_clips.size(); row++) {
+        const BrowserClip & clip = browser_clips[first + row];
+        int y = top + row * BROWSER_ROW_HEIGHT;
+
+        if (first + row == browser_selected) {
+            SDL_Rect highlight = {0, y, WINDOW_WIDTH, BROWSER_ROW_HEIGHT};
+            SDL_FillRect(screen_surface, &highlight, SDL_MapRGB(screen_surface->format, 220, 200, 210));
+        }
+
+        std::string name = clip.filename.substr(clip.filename.find_last_of('/') + 1);
+        std::stringstream ss;
+        ss << (clip_playing == &clip ? "> " : "  ") << name << "  ";
+        ss.precision(1);
+        ss << std::fixed << (double)clip.wav.sample_count / clip.wav.sample_rate << "s";
+
+        interface_draw_string(ss.str(), 5, y, 96, 32, 64);
+    }
+
+    // Selected clip, drawn from its cached peaks.
+    const BrowserClip & clip = browser_clips[browser_selected];
+    int wave_top = top + BROWSER_ROWS * BROWSER_ROW_HEIGHT;
+    int mid = wave_top + BROWSER_WAVEFORM_HEIGHT / 2;
+    int half = BROWSER_WAVEFORM_HEIGHT / 2 - 1;
+    uint32_t wave_color = SDL_MapRGB(screen_surface->format, 144, 96, 120);
+
+    for (int x = 0; x < (int)clip.peaks.size(); x++) {
+        int y_max = mid - clip.peaks[x].max * half / 32768;
+        int y_min = mid - clip.peaks[x].min * half / 32768;
+        SDL_Rect column = {x, y_max, 1, y_min - y_max + 1};
+        SDL_FillRect(screen_surface, &column, wave_color);
+    }
+
+    if (clip_playing == &clip && clip.wav.sample_count > 0) {
+        size_t position = std::min<size_t>(clip_playback_position, clip.wav.sample_count);
+        SDL_Rect playhead = {(int)(position * WINDOW_WIDTH / clip.wav.sample_count), wave_top, 1, BROWSER_WAVEFORM_HEIGHT};
+        SDL_FillRect(screen_surface, &playhead, SDL_MapRGB(screen_surface->format, 48, 0, 32));
+    }
+}
+
 void interface_render() {
     if (!needs_redraw) {
         return;
@@ -336,9 +620,18 @@ void interface_render() {
     if (is_capturing_audio) {
         SDL_FillRect(screen_surface, nullptr, SDL_MapRGB(screen_surface->format, 235, 220, 226));
     
-        ss << frame_count << " " << audio_device_name;
-        
-        interface_draw_string(ss.str(), 5, 5, 96, 32, 64);
+        if (capture_error) {
+            ss << frame_count << " " << *capture_error;
+            interface_draw_string(ss.str(), 5, 5, 200, 0, 0);
+        } else {
+            if (tuner_is_calibrating()) {
+                ss << frame_count << " " << "Calibrating...";
+            } else {
+                ss << frame_count << " " << audio_device_name;
+            }
+
+            interface_draw_string(ss.str(), 5, 5, 96, 32, 64);
+        }
         interface_render_waveform();
     } else {
         SDL_FillRect(screen_surface, nullptr, SDL_MapRGB(screen_surface->format, 195, 200, 205));
@@ -348,6 +641,8 @@ void interface_render() {
         interface_draw_string(ss.str(), 5, 5, 60, 72, 90);
     }
 
+    interface_render_browser();
+
     SDL_UpdateWindowSurface(window);
     needs_redraw = false;
 }
@@ -1,9 +1,36 @@
 #include <SDL.h>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
 #include "config.h"
 #include "interface.h"
 #include "output_queue.h"
+#include "tuner.h"
+#include "wavfile.h"
 
 int main(int argc, char *argv[]) {
+
+    // --calibrate-wav <file>: measure latency from a recording of the
+    // loopback click (starting at the moment it was played) instead of
+    // playing one through the live device.
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::string(argv[i]) == "--calibrate-wav") {
+            std::vector<int16_t> samples;
+            int sample_rate = 0;
+            if (!read_wav(argv[i + 1], samples, sample_rate)) {
+                return 1;
+            }
+
+            std::optional<double> latency = tuner_calibrate_from_recording(samples, sample_rate);
+            if (!latency) {
+                std::cerr << "No calibration click found in " << argv[i + 1] << std::endl;
+                return 1;
+            }
+            std::cout << "Measured latency: " << *latency * 1000.0 << " ms, pad "
+                << tuner_latency_pad() << " samples" << std::endl;
+        }
+    }
     
     output_queue_start_thread();
 
@@ -17,6 +44,7 @@ int main(int argc, char *argv[]) {
     }
     
     interface_teardown();
+    output_queue_stop();
     
     return 0;
 
@@ -0,0 +1,80 @@
+#include "mapped_wav.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wavfile.h"
+
+std::optional<MappedWav> mapped_wav_open(const std::string & filename, std::string & error) {
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = errno_string("Unable to open", filename);
+        return std::nullopt;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(WAVHeader)) {
+        error = filename + " is too short to be a .wav";
+        close(fd);
+        return std::nullopt;
+    }
+
+    MappedWav wav;
+    wav.mapping_size = st.st_size;
+    wav.mapping = mmap(nullptr, wav.mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file.
+    close(fd);
+
+    if (wav.mapping == MAP_FAILED) {
+        error = errno_string("Unable to map", filename);
+        return std::nullopt;
+    }
+
+    WAVHeader header;
+    memcpy(&header, wav.mapping, sizeof(WAVHeader));
+    if (!wav_header_is_pcm16_mono(header)) {
+        error = filename + " is not a 16-bit mono PCM .wav";
+        munmap(wav.mapping, wav.mapping_size);
+        return std::nullopt;
+    }
+
+    // Playback walks the file front to back.
+    madvise(wav.mapping, wav.mapping_size, MADV_SEQUENTIAL);
+
+    size_t data_bytes = std::min<size_t>(header.subchunk2Size, wav.mapping_size - sizeof(WAVHeader));
+    wav.samples = reinterpret_cast<const int16_t *>(static_cast<const char *>(wav.mapping) + sizeof(WAVHeader));
+    wav.sample_count = data_bytes / sizeof(int16_t);
+    wav.sample_rate = header.sampleRate;
+    return wav;
+}
+
+void mapped_wav_close(MappedWav & wav) {
+    if (wav.mapping) {
+        munmap(wav.mapping, wav.mapping_size);
+        wav.mapping = nullptr;
+        wav.samples = nullptr;
+        wav.sample_count = 0;
+    }
+}
+
+std::vector<WavPeak> mapped_wav_peaks(const MappedWav & wav, int columns) {
+    std::vector<WavPeak> peaks(columns, WavPeak{0, 0});
+
+    for (int x = 0; x < columns && wav.sample_count > 0; x++) {
+        size_t begin = x * wav.sample_count / columns;
+        size_t end = std::max(begin + 1, (x + 1) * wav.sample_count / columns);
+        end = std::min(end, wav.sample_count);
+
+        if (begin >= end) {
+            continue;
+        }
+        auto [lo, hi] = std::minmax_element(wav.samples + begin, wav.samples + end);
+        peaks[x] = WavPeak{*lo, *hi};
+    }
+    return peaks;
+}
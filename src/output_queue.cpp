@@ -1,22 +1,35 @@
 #include <vector>
 #include <mutex>
+#include <condition_variable>
 #include <string>
 #include <optional>
+#include <algorithm>
 #include <cstdint>
 #include <ctime>
 #include <cstdio>
 #include <thread>
 #include <chrono>
 #include <iostream>
+#include <iterator>
 
 #include "output_queue.h"
-#include "wavfile.h"
+#include "config.h"
+#include "durable_write.h"
 
 enum class JobStatus {
     NEW,
-    WAV_OUTPUT_DONE,
 
-    FINISHED
+    // In its temp file, waiting for the next batched sync.
+    WRITTEN,
+
+    // Under its real name with its data synced, but the directory sync
+    // failed. Only that sync is retried; the file is never rewritten.
+    RENAMED,
+
+    FINISHED,
+
+    // Out of attempts. The error has been reported.
+    FAILED
 };
 
 struct OutputJob {
@@ -26,17 +39,29 @@ struct OutputJob {
     std::vector<int16_t> samples;
     int sample_rate;
 
+    int attempts;
+    std::chrono::steady_clock::time_point not_before;
+    std::chrono::steady_clock::time_point written_at;
+    std::optional<DurableWrite> write;
+
     OutputJob(std::string filename, std::vector<int16_t> samples, int sample_rate) : 
         status(JobStatus::NEW),
         filename(filename),
         samples(samples),
-        sample_rate(sample_rate)
+        sample_rate(sample_rate),
+        attempts(0)
     {}
 };
 
+// New jobs land here under the lock. The poll thread moves them out before
+// doing any I/O, so the audio thread never waits on the disk.
 std::mutex output_queue_mutex;
 std::vector<OutputJob> output_queue;
+std::vector<std::string> finished_filenames;
+std::vector<std::string> failed_filenames;
 bool should_quit_oq_thread = false;
+std::condition_variable oq_wakeup;
+std::thread oq_thread;
 
 std::string gen_filename() {
     // filename is based on current unix time
@@ -49,7 +74,7 @@ std::string gen_filename() {
     char buffer[80];
     strftime(buffer, 80, "%Y%m%d-%H%M%S", timeinfo);
     std::string filename(buffer);
-    filename = "captures/" + filename + "-" + std::to_string(rand() % 10000) + ".wav";
+    filename = std::string(CAPTURE_DIRECTORY) + "/" + filename + "-" + std::to_string(rand() % 10000) + ".wav";
 
     return filename;
 }
@@ -64,39 +89,211 @@ void output_queue_push(int16_t * samples, size_t sample_count, int sample_rate)
 }
 
 
+std::vector<std::string> output_queue_take_finished() {
+    std::lock_guard<std::mutex> lock(output_queue_mutex);
+
+    std::vector<std::string> finished;
+    finished.swap(finished_filenames);
+    return finished;
+}
+
+std::vector<std::string> output_queue_take_failed() {
+    std::lock_guard<std::mutex> lock(output_queue_mutex);
+
+    std::vector<std::string> failed;
+    failed.swap(failed_filenames);
+    return failed;
+}
+
+
 // module private
-void oq_poll_thread() {
-    while (true) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+//
+// With `can_retry` false (shutting down) the job is given up on straight away.
+void oq_job_failed(OutputJob & job, const std::string & error, bool can_retry) {
+    job.write = std::nullopt;
+    job.attempts++;
+
+    if (!can_retry || job.attempts >= OUTPUT_MAX_ATTEMPTS) {
+        std::cerr << "Error: giving up on " << job.filename << " after " << job.attempts
+            << " attempts: " << error << std::endl;
+        job.status = JobStatus::FAILED;
 
         std::lock_guard<std::mutex> lock(output_queue_mutex);
+        failed_filenames.push_back(job.filename);
+        return;
+    }
 
-        if (should_quit_oq_thread) {
-            return;
+    std::cerr << "Error: " << error << " (attempt " << job.attempts << ", will retry)" << std::endl;
+    job.status = JobStatus::NEW;
+    job.not_before = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(OUTPUT_RETRY_BACKOFF_MS * job.attempts);
+}
+
+// module private
+//
+// Called when the directory sync after a rename fails. The capture is on
+// disk and readable, so running out of attempts finishes it with a warning
+// rather than failing it.
+void oq_directory_sync_failed(OutputJob & job, const std::string & error, bool can_retry) {
+    job.write = std::nullopt;
+    job.attempts++;
+
+    if (!can_retry || job.attempts >= OUTPUT_MAX_ATTEMPTS) {
+        std::cerr << "Warning: wrote " << job.filename << " but its directory entry may not survive a crash: "
+            << error << std::endl;
+        job.status = JobStatus::FINISHED;
+
+        std::lock_guard<std::mutex> lock(output_queue_mutex);
+        finished_filenames.push_back(job.filename);
+        return;
+    }
+
+    std::cerr << "Error: " << error << " (attempt " << job.attempts << ", will retry)" << std::endl;
+    job.status = JobStatus::RENAMED;
+    job.not_before = std::chrono::steady_clock::now()
+        + std::chrono::milliseconds(OUTPUT_RETRY_BACKOFF_MS * job.attempts);
+}
+
+// module private
+//
+// Writes every NEW job that's due to its temp file.
+void oq_write_new(std::vector<OutputJob> & jobs, std::chrono::steady_clock::time_point now, bool can_retry) {
+    for (auto & job : jobs) {
+        if (job.status == JobStatus::NEW && job.not_before <= now) {
+            std::cout << "Writing " << job.filename << std::endl;
+            std::string error;
+            job.write = durable_write_begin(
+                job.samples.data(), job.samples.size(), job.sample_rate, job.filename, error);
+            if (job.write) {
+                job.status = JobStatus::WRITTEN;
+                job.written_at = now;
+            } else {
+                oq_job_failed(job, error, can_retry);
+            }
         }
+    }
+}
 
-        for (auto & job : output_queue) {
-            if (job.status == JobStatus::NEW) {
-                job.status = JobStatus::WAV_OUTPUT_DONE;
-                std::cout << "Writing " << job.filename << std::endl;
-                write_wav(job.samples.data(), job.samples.size(), job.sample_rate, job.filename);
-            } else if (job.status == JobStatus::WAV_OUTPUT_DONE) {
+// module private
+//
+// Retries the directory sync for every RENAMED job that's due.
+void oq_sync_renamed(std::vector<OutputJob> & jobs, std::chrono::steady_clock::time_point now, bool can_retry) {
+    for (auto & job : jobs) {
+        if (job.status == JobStatus::RENAMED && job.not_before <= now) {
+            std::string error;
+            if (durable_write_sync_directory(job.filename, error)) {
+                std::cout << "Wrote " << job.filename << std::endl;
                 job.status = JobStatus::FINISHED;
+
+                std::lock_guard<std::mutex> lock(output_queue_mutex);
+                finished_filenames.push_back(job.filename);
+            } else {
+                oq_directory_sync_failed(job, error, can_retry);
             }
         }
+    }
+}
+
+// module private
+//
+// Syncs and renames every WRITTEN job in one batch.
+void oq_commit_written(std::vector<OutputJob> & jobs, bool can_retry) {
+    std::vector<OutputJob *> batch_jobs;
+    std::vector<DurableWrite> batch;
+    for (auto & job : jobs) {
+        if (job.status == JobStatus::WRITTEN) {
+            batch_jobs.push_back(&job);
+            batch.push_back(*job.write);
+        }
+    }
+
+    std::vector<std::string> errors = durable_write_commit(batch);
+
+    std::vector<std::string> finished;
+    for (size_t i = 0; i < batch_jobs.size(); i++) {
+        OutputJob & job = *batch_jobs[i];
+        if (errors[i].empty()) {
+            std::cout << "Wrote " << job.filename << std::endl;
+            job.write = std::nullopt;
+            job.status = JobStatus::FINISHED;
+            finished.push_back(job.filename);
+        } else if (batch[i].renamed) {
+            oq_directory_sync_failed(job, errors[i], can_retry);
+        } else {
+            oq_job_failed(job, errors[i], can_retry);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(output_queue_mutex);
+    finished_filenames.insert(finished_filenames.end(), finished.begin(), finished.end());
+}
+
+// module private
+void oq_poll_thread() {
+    // Temp files left by a crash or power loss are never going to be
+    // committed; their captures are gone either way.
+    durable_write_remove_stale(CAPTURE_DIRECTORY);
+
+    // Jobs owned by this thread. Only touched here, so no lock needed.
+    std::vector<OutputJob> jobs;
+
+    while (true) {
+        bool quitting;
+        {
+            std::unique_lock<std::mutex> lock(output_queue_mutex);
+            oq_wakeup.wait_for(lock, std::chrono::milliseconds(100), [] { return should_quit_oq_thread; });
+            quitting = should_quit_oq_thread;
+
+            std::move(output_queue.begin(), output_queue.end(), std::back_inserter(jobs));
+            output_queue.clear();
+        }
 
-        output_queue.erase(
+        auto now = std::chrono::steady_clock::now();
+
+        if (quitting) {
+            // Last chance: write everything, backoff or not, and sync it now.
+            oq_write_new(jobs, std::chrono::steady_clock::time_point::max(), false);
+            oq_commit_written(jobs, false);
+            oq_sync_renamed(jobs, std::chrono::steady_clock::time_point::max(), false);
+            return;
+        }
+
+        oq_write_new(jobs, now, true);
+        oq_sync_renamed(jobs, now, true);
+
+        // Hold written jobs until the oldest has waited out the sync window,
+        // so captures that finish close together share a single sync.
+        bool sync_due = std::any_of(jobs.begin(), jobs.end(), [&](OutputJob & job) {
+            return job.status == JobStatus::WRITTEN
+                && now - job.written_at >= std::chrono::milliseconds(OUTPUT_SYNC_WINDOW_MS);
+        });
+        if (sync_due) {
+            oq_commit_written(jobs, true);
+        }
+
+        jobs.erase(
             std::remove_if(
-                output_queue.begin(), 
-                output_queue.end(), 
-                [](OutputJob & job) { return job.status == JobStatus::FINISHED; }
+                jobs.begin(), 
+                jobs.end(), 
+                [](OutputJob & job) { return job.status == JobStatus::FINISHED || job.status == JobStatus::FAILED; }
             ),
-            output_queue.end()
+            jobs.end()
         );
     }
 }
 
 void output_queue_start_thread() {
-    std::thread t(oq_poll_thread);
-    t.detach();
-}
\ No newline at end of file
+    oq_thread = std::thread(oq_poll_thread);
+}
+
+void output_queue_stop() {
+    {
+        std::lock_guard<std::mutex> lock(output_queue_mutex);
+        should_quit_oq_thread = true;
+    }
+    oq_wakeup.notify_all();
+
+    if (oq_thread.joinable()) {
+        oq_thread.join();
+    }
+}
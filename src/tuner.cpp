@@ -0,0 +1,303 @@
+#include "tuner.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+
+#include "config.h"
+
+// All tuner state lives behind one mutex: the audio thread feeds it timing
+// and samples, the main thread reads decisions back out.
+
+enum class TunerState {
+    // Stepping down through TUNER_BUFFER_SIZES while callbacks stay stable.
+    PROBING,
+
+    // Found the floor. Steps back up if the device stays unstable, and
+    // goes back to probing after a long stable stretch.
+    LOCKED
+};
+
+std::mutex tuner_mutex;
+
+TunerState tuner_state = TunerState::PROBING;
+int requested_buffer_size = BUFFER_SIZE;
+int opened_buffer_size = BUFFER_SIZE;
+int opened_sample_rate = SAMPLE_RATE;
+bool reopen_requested = false;
+
+// False once the device has refused to go any smaller than it already was;
+// probing would only ask for the same thing again.
+bool device_honours_buffer_size = true;
+
+int unstable_windows = 0;
+int stable_windows = 0;
+
+std::optional<double> last_tick;
+int warmup_remaining = TUNER_WARMUP_CALLBACKS;
+std::vector<double> callback_intervals;
+double measured_jitter = 0.0;
+
+// Peak level of the last callback, so the click threshold can sit above the
+// room noise.
+int16_t recent_peak = 0;
+
+bool calibrating = false;
+size_t calibration_samples_seen = 0;
+int16_t calibration_threshold = CALIBRATION_CLICK_THRESHOLD;
+std::optional<double> measured_latency;
+
+
+int16_t peak_level(const int16_t * samples, size_t sample_count) {
+    int peak = 0;
+    for (size_t i = 0; i < sample_count; i++) {
+        peak = std::max(peak, std::abs(static_cast<int>(samples[i])));
+    }
+    return static_cast<int16_t>(std::min(peak, 32767));
+}
+
+int16_t click_threshold(int16_t noise_peak) {
+    int threshold = std::max<int>(CALIBRATION_CLICK_THRESHOLD, CALIBRATION_NOISE_RATIO * noise_peak);
+    return static_cast<int16_t>(std::min(threshold, 32767));
+}
+
+// Index of the first sample at or above the threshold, if any.
+std::optional<size_t> find_click(const int16_t * samples, size_t sample_count, int16_t threshold) {
+    for (size_t i = 0; i < sample_count; i++) {
+        if (std::abs(static_cast<int>(samples[i])) >= threshold) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+int next_smaller_buffer_size(int size) {
+    std::optional<int> best;
+    for (int candidate : TUNER_BUFFER_SIZES) {
+        if (candidate < size) {
+            best = candidate;
+        }
+    }
+    return best.value_or(size);
+}
+
+int next_larger_buffer_size(int size) {
+    for (int candidate : TUNER_BUFFER_SIZES) {
+        if (candidate > size) {
+            return candidate;
+        }
+    }
+    return size;
+}
+
+// DOES NOT ACQUIRE THE LOCK!!! Do it from the caller!
+void nolock_request_buffer_size(int size) {
+    if (size == opened_buffer_size) {
+        return;
+    }
+    std::cout << "Tuner: requesting buffer size " << size << std::endl;
+    requested_buffer_size = size;
+    reopen_requested = true;
+}
+
+// DOES NOT ACQUIRE THE LOCK!!! Do it from the caller!
+//
+// Called once a full window of intervals is in. Decides whether to step the
+// buffer size down, up, or leave it alone.
+void nolock_evaluate_window() {
+    double period = static_cast<double>(opened_buffer_size) / opened_sample_rate;
+
+    double mean = 0.0;
+    double worst = 0.0;
+    for (double interval : callback_intervals) {
+        mean += interval;
+        worst = std::max(worst, interval);
+    }
+    mean /= callback_intervals.size();
+
+    double variance = 0.0;
+    for (double interval : callback_intervals) {
+        variance += (interval - mean) * (interval - mean);
+    }
+    measured_jitter = std::sqrt(variance / callback_intervals.size());
+
+    bool stable = worst < TUNER_MAX_INTERVAL_RATIO * period
+        && measured_jitter < TUNER_MAX_JITTER_RATIO * period;
+
+    callback_intervals.clear();
+
+    if (!stable) {
+        stable_windows = 0;
+        unstable_windows++;
+        std::cout << "Tuner: buffer size " << opened_buffer_size << " unstable (jitter "
+            << measured_jitter * 1000.0 << " ms, worst interval " << worst * 1000.0 << " ms)" << std::endl;
+
+        if (unstable_windows >= TUNER_UNSTABLE_WINDOWS) {
+            unstable_windows = 0;
+            tuner_state = TunerState::LOCKED;
+            nolock_request_buffer_size(next_larger_buffer_size(opened_buffer_size));
+        }
+        return;
+    }
+
+    unstable_windows = 0;
+    stable_windows++;
+
+    if (tuner_state == TunerState::LOCKED
+        && device_honours_buffer_size
+        && stable_windows >= TUNER_REPROBE_WINDOWS
+    ) {
+        tuner_state = TunerState::PROBING;
+    }
+
+    if (tuner_state == TunerState::PROBING) {
+        int smaller = next_smaller_buffer_size(opened_buffer_size);
+        if (smaller == opened_buffer_size) {
+            tuner_state = TunerState::LOCKED;
+        } else {
+            nolock_request_buffer_size(smaller);
+        }
+    }
+}
+
+void tuner_device_opened(int buffer_size, int sample_rate) {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+
+    // Backends often round the size (to a period, or a power of two), so
+    // whatever we got becomes the size to step from. Only a device that
+    // answers a smaller request with no smaller size has hit its floor.
+    if (requested_buffer_size < opened_buffer_size && buffer_size >= opened_buffer_size) {
+        std::cout << "Tuner: device won't go below buffer size " << opened_buffer_size << std::endl;
+        tuner_state = TunerState::LOCKED;
+        device_honours_buffer_size = false;
+    }
+
+    opened_buffer_size = buffer_size;
+    opened_sample_rate = sample_rate;
+    requested_buffer_size = buffer_size;
+    reopen_requested = false;
+
+    unstable_windows = 0;
+    stable_windows = 0;
+
+    last_tick = std::nullopt;
+    warmup_remaining = TUNER_WARMUP_CALLBACKS;
+    callback_intervals.clear();
+    callback_intervals.reserve(TUNER_WINDOW_CALLBACKS);
+
+    // Timing from a closed device says nothing about latency on this one.
+    calibrating = false;
+}
+
+void tuner_callback_tick(double now, const int16_t * samples, size_t sample_count) {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+
+    if (calibrating) {
+        std::optional<size_t> click = find_click(samples, sample_count, calibration_threshold);
+        if (click) {
+            calibration_samples_seen += *click;
+            measured_latency = static_cast<double>(calibration_samples_seen) / opened_sample_rate;
+            calibrating = false;
+            std::cout << "Tuner: measured latency " << *measured_latency * 1000.0 << " ms" << std::endl;
+        } else {
+            calibration_samples_seen += sample_count;
+            if (calibration_samples_seen > CALIBRATION_TIMEOUT_SECONDS * opened_sample_rate) {
+                calibrating = false;
+                std::cout << "Tuner: calibration click not detected" << std::endl;
+            }
+        }
+    } else {
+        recent_peak = peak_level(samples, sample_count);
+    }
+
+    if (reopen_requested) {
+        return;
+    }
+
+    if (last_tick) {
+        if (warmup_remaining > 0) {
+            warmup_remaining--;
+        } else {
+            callback_intervals.push_back(now - *last_tick);
+        }
+    }
+    last_tick = now;
+
+    if (callback_intervals.size() == TUNER_WINDOW_CALLBACKS) {
+        nolock_evaluate_window();
+    }
+}
+
+int tuner_buffer_size() {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+    return requested_buffer_size;
+}
+
+bool tuner_take_reopen_request() {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+    bool requested = reopen_requested;
+    reopen_requested = false;
+    return requested;
+}
+
+void tuner_begin_calibration() {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+
+    calibrating = true;
+    calibration_samples_seen = 0;
+    calibration_threshold = click_threshold(recent_peak);
+}
+
+bool tuner_is_calibrating() {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+    return calibrating;
+}
+
+std::optional<double> tuner_calibrate_from_recording(const std::vector<int16_t> & samples, int sample_rate) {
+    // The live test takes its noise floor from the callback before the click
+    // was played. Here everything ahead of the click is that noise, so the
+    // threshold rises with the loudest sample seen so far.
+    int16_t noise_peak = 0;
+    std::optional<size_t> click;
+    for (size_t i = 0; i < samples.size(); i++) {
+        int16_t level = static_cast<int16_t>(std::min(std::abs(static_cast<int>(samples[i])), 32767));
+        if (level >= click_threshold(noise_peak)) {
+            click = i;
+            break;
+        }
+        noise_peak = std::max(noise_peak, level);
+    }
+
+    if (!click) {
+        return std::nullopt;
+    }
+
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+    measured_latency = static_cast<double>(*click) / sample_rate;
+    return measured_latency;
+}
+
+std::optional<double> tuner_measured_latency() {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+    return measured_latency;
+}
+
+size_t tuner_latency_pad() {
+    std::lock_guard<std::mutex> lock(tuner_mutex);
+
+    if (!measured_latency) {
+        return SAMPLE_QUEUE_LATENCY;
+    }
+
+    // The click can land anywhere in a buffer, so allow a full period on top
+    // of the measured latency, plus a few standard deviations of jitter.
+    double period = static_cast<double>(opened_buffer_size) / opened_sample_rate;
+    double pad_seconds = *measured_latency + period + 3.0 * measured_jitter + TUNER_PAD_MARGIN_SECONDS;
+
+    // May come out above SAMPLE_QUEUE_LATENCY on a slow device; that's the
+    // point. It must still fit in what the queue keeps when idle.
+    size_t pad = static_cast<size_t>(std::ceil(pad_seconds * opened_sample_rate * CHANNELS));
+    return std::min(pad, SAMPLE_QUEUE_SHRINK_TO);
+}
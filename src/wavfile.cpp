@@ -4,14 +4,11 @@
 #include <iostream>
 #include <cstring>
 #include <cstdlib>
-#include <stdexcept>
+#include <cerrno>
 
 #include "wavfile.h"
 
-bool write_wav(int16_t *samples, size_t sample_count, int sample_rate, const std::string &filename) {
-    
-    // Set up WAV header
-    WAVHeader header;
+void fill_wav_header(WAVHeader &header, size_t sample_count, int sample_rate) {
     memcpy(header.riff, "RIFF", 4);
     header.chunkSize = 36 + sample_count * sizeof(int16_t);
     memcpy(header.wave, "WAVE", 4);
@@ -25,21 +22,40 @@ bool write_wav(int16_t *samples, size_t sample_count, int sample_rate, const std
     header.blockAlign = header.numChannels * header.bitsPerSample / 8;
     memcpy(header.data, "data", 4);
     header.subchunk2Size = sample_count * sizeof(int16_t);
+}
+
+bool wav_header_is_pcm16_mono(const WAVHeader &header) {
+    return memcmp(header.riff, "RIFF", 4) == 0
+        && memcmp(header.wave, "WAVE", 4) == 0
+        && memcmp(header.data, "data", 4) == 0
+        && header.audioFormat == 1
+        && header.numChannels == 1
+        && header.bitsPerSample == 16;
+}
+
+std::string errno_string(const std::string &what, const std::string &filename) {
+    return what + " " + filename + ": " + strerror(errno);
+}
 
-    // Write WAV header and samples to file
-    std::ofstream outFile(filename, std::ios::binary);
-    if (!outFile) {
-        std::cerr << "Error: Unable to open output file " << filename << std::endl;
+bool read_wav(const std::string &filename, std::vector<int16_t> &samples, int &sample_rate) {
+
+    std::ifstream inFile(filename, std::ios::binary);
+    if (!inFile) {
+        std::cerr << "Error: Unable to open input file " << filename << std::endl;
         return false;
     }
 
-    outFile.write(reinterpret_cast<const char *>(&header), sizeof(WAVHeader));
-    outFile.write(reinterpret_cast<const char *>(samples), sample_count * sizeof(int16_t));
-
-    if (!outFile) {
-        throw std::runtime_error("Error writing .wav to output file");
+    WAVHeader header;
+    inFile.read(reinterpret_cast<char *>(&header), sizeof(WAVHeader));
+    if (!inFile || !wav_header_is_pcm16_mono(header)) {
+        std::cerr << "Error: " << filename << " is not a 16-bit mono PCM .wav" << std::endl;
+        return false;
     }
 
-    outFile.close();
+    samples.resize(header.subchunk2Size / sizeof(int16_t));
+    inFile.read(reinterpret_cast<char *>(samples.data()), samples.size() * sizeof(int16_t));
+    samples.resize(inFile.gcount() / sizeof(int16_t));
+
+    sample_rate = header.sampleRate;
     return true;
-}
+}
\ No newline at end of file
@@ -0,0 +1,351 @@
+/*
+    audioproc_stress.cpp
+
+    Stress harness for the audioproc module. The SDL audio callback is
+    replaced by a virtual clock that feeds audio_samples_acquired() with a
+    known sample pattern, and output_queue_push() is replaced by a stub that
+    records every emitted capture so it can be checked.
+
+    Usage: audioproc_stress <deterministic|concurrent> [seed] [iterations]
+
+    deterministic: one thread interleaves randomised callbacks and
+        begin/end requests, and every capture is compared sample for sample
+        against a reference model of the capture rules in audioproc.cpp.
+
+    concurrent: the virtual clock, a capture-button thread and a status
+        poller run on real threads (build with the tsan preset to catch
+        races). Captures are checked against invariants that hold under any
+        interleaving.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audioproc.h"
+#include "config.h"
+#include "output_queue.h"
+
+struct Capture {
+    std::vector<int16_t> samples;
+    int sample_rate;
+};
+
+std::mutex captures_mutex;
+std::vector<Capture> captures;
+
+// Stands in for the real output queue; no files are written.
+void output_queue_push(int16_t * samples, size_t sample_count, int sample_rate) {
+    std::lock_guard<std::mutex> lock(captures_mutex);
+    captures.push_back(Capture{std::vector<int16_t>(samples, samples + sample_count), sample_rate});
+}
+
+void output_queue_start_thread() {}
+
+std::vector<Capture> take_captures() {
+    std::lock_guard<std::mutex> lock(captures_mutex);
+    std::vector<Capture> taken;
+    taken.swap(captures);
+    return taken;
+}
+
+// The sample at absolute position `pos` in the input stream. Wraps every
+// 65536 samples, so consecutive samples always differ by exactly one.
+int16_t pattern_sample(uint64_t pos) {
+    return static_cast<int16_t>(static_cast<uint16_t>(pos));
+}
+
+// Replaces the SDL callback. Each tick delivers one buffer of the pattern
+// and advances virtual time by the buffer length.
+class VirtualAudioClock {
+public:
+    void tick(size_t sample_count) {
+        buffer.resize(sample_count);
+        for (size_t i = 0; i < sample_count; i++) {
+            buffer[i] = pattern_sample(position + i);
+        }
+        audio_samples_acquired(buffer.data(), sample_count);
+        position += sample_count;
+    }
+
+    uint64_t now() const {
+        return position;
+    }
+
+private:
+    std::atomic<uint64_t> position{0};
+    std::vector<int16_t> buffer;
+};
+
+// Mirrors the capture rules of audioproc.cpp in absolute sample positions,
+// so it never has to reason about the queue being shrunk underneath it.
+class ReferenceModel {
+public:
+    struct Span {
+        uint64_t start;
+        uint64_t end;
+    };
+
+    std::optional<Span> samples_acquired(size_t sample_count) {
+        std::optional<Span> emitted;
+        total += sample_count;
+
+        if (capturing && ending && total > end) {
+            emitted = Span{start, end};
+            capturing = false;
+            ending = false;
+        }
+
+        if (!capturing && total - base > SAMPLE_QUEUE_NOT_LISTENING_MAX_SIZE) {
+            base = total - SAMPLE_QUEUE_SHRINK_TO;
+        }
+        return emitted;
+    }
+
+    void begin_capture() {
+        if (capturing) {
+            ending = false;
+        } else {
+            start = std::max(base, total > pad ? total - pad : 0);
+            capturing = true;
+        }
+    }
+
+    void end_capture() {
+        if (capturing) {
+            end = total + pad;
+            ending = true;
+        }
+    }
+
+    void set_latency_pad(size_t new_pad) {
+        pad = new_pad;
+    }
+
+    bool is_capturing() const {
+        return capturing;
+    }
+
+private:
+    uint64_t total = 0;
+    uint64_t base = 0;
+    uint64_t pad = SAMPLE_QUEUE_LATENCY;
+
+    // Plain flags rather than optionals: GCC's -Wmaybe-uninitialized can't
+    // see through optional<uint64_t> at -O2 and up.
+    bool capturing = false;
+    bool ending = false;
+    uint64_t start = 0;
+    uint64_t end = 0;
+};
+
+int failures = 0;
+
+void fail(const std::string & msg) {
+    if (failures < 20) {
+        std::cerr << "FAIL: " << msg << std::endl;
+    }
+    failures++;
+}
+
+size_t random_buffer_size(std::mt19937_64 & rng) {
+    // Mostly the configured size, sometimes whatever the driver feels like.
+    if (rng() % 4 != 0) {
+        return BUFFER_SIZE;
+    }
+    return 1 + rng() % (2 * BUFFER_SIZE);
+}
+
+void run_deterministic(uint64_t seed, int iterations) {
+    std::mt19937_64 rng(seed);
+    VirtualAudioClock clock;
+    ReferenceModel model;
+    size_t checked = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        switch (rng() % 9) {
+            case 0:
+                audio_begin_capture();
+                model.begin_capture();
+                break;
+            case 1:
+                audio_end_capture();
+                model.end_capture();
+                break;
+            case 2: {
+                // Anything the tuner could hand us, from nothing up to the
+                // idle queue length.
+                size_t pad = (rng() % 4 != 0)
+                    ? rng() % (2 * SAMPLE_QUEUE_LATENCY)
+                    : rng() % (SAMPLE_QUEUE_SHRINK_TO + 1);
+                audio_set_latency_pad(pad);
+                model.set_latency_pad(pad);
+                break;
+            }
+            default: {
+                size_t n = random_buffer_size(rng);
+                clock.tick(n);
+                std::optional<ReferenceModel::Span> expected = model.samples_acquired(n);
+                std::vector<Capture> got = take_captures();
+
+                if (got.size() != (expected ? 1u : 0u)) {
+                    fail("iteration " + std::to_string(i) + ": expected "
+                        + std::to_string(expected ? 1 : 0) + " captures, got "
+                        + std::to_string(got.size()));
+                    break;
+                }
+                if (!expected) {
+                    break;
+                }
+
+                const Capture & c = got.front();
+                size_t expected_len = expected->end - expected->start;
+                if (c.samples.size() != expected_len) {
+                    fail("iteration " + std::to_string(i) + ": capture length "
+                        + std::to_string(c.samples.size()) + " != " + std::to_string(expected_len));
+                    break;
+                }
+                for (size_t k = 0; k < expected_len; k++) {
+                    if (c.samples[k] != pattern_sample(expected->start + k)) {
+                        fail("iteration " + std::to_string(i) + ": sample " + std::to_string(k)
+                            + " of capture differs from reference");
+                        break;
+                    }
+                }
+                checked++;
+                break;
+            }
+        }
+
+        if (audio_is_capturing() != model.is_capturing()) {
+            fail("iteration " + std::to_string(i) + ": audio_is_capturing() disagrees with reference");
+        }
+    }
+
+    std::cerr << "deterministic: " << checked << " captures checked against reference, "
+        << clock.now() << " samples fed" << std::endl;
+}
+
+void check_capture_invariants(const Capture & c) {
+    if (c.sample_rate != SAMPLE_RATE) {
+        fail("capture has sample rate " + std::to_string(c.sample_rate));
+    }
+    // end is set LATENCY samples past the queue end, and start is never past it.
+    if (c.samples.size() < SAMPLE_QUEUE_LATENCY) {
+        fail("capture of " + std::to_string(c.samples.size()) + " samples is shorter than the latency pad");
+    }
+    for (size_t k = 1; k < c.samples.size(); k++) {
+        if (static_cast<uint16_t>(c.samples[k]) != static_cast<uint16_t>(c.samples[k - 1] + 1)) {
+            fail("capture is not a contiguous run of the input at sample " + std::to_string(k));
+            return;
+        }
+    }
+}
+
+void run_concurrent(uint64_t seed, int iterations) {
+    VirtualAudioClock clock;
+    std::atomic<bool> done(false);
+    std::atomic<size_t> end_requests(0);
+
+    std::thread audio_thread([&] {
+        std::mt19937_64 rng(seed);
+        while (!done) {
+            clock.tick(random_buffer_size(rng));
+            std::this_thread::yield();
+        }
+    });
+
+    std::thread poll_thread([&] {
+        while (!done) {
+            audio_is_capturing();
+            std::this_thread::yield();
+        }
+    });
+
+    std::mt19937_64 rng(seed ^ 0x9e3779b97f4a7c15ull);
+    size_t checked = 0;
+    for (int i = 0; i < iterations; i++) {
+        // Hold each state for a random stretch of virtual time, from well
+        // under one buffer to several latency pads.
+        uint64_t until = clock.now() + rng() % (4 * SAMPLE_QUEUE_LATENCY);
+        while (clock.now() < until) {
+            std::this_thread::yield();
+        }
+
+        if (rng() % 2) {
+            audio_begin_capture();
+        } else {
+            audio_end_capture();
+            end_requests++;
+        }
+
+        for (const Capture & c : take_captures()) {
+            check_capture_invariants(c);
+            checked++;
+        }
+    }
+
+    // Let any pending capture drain before stopping the clock.
+    audio_end_capture();
+    end_requests++;
+    uint64_t until = clock.now() + 2 * SAMPLE_QUEUE_LATENCY;
+    while (clock.now() < until) {
+        std::this_thread::yield();
+    }
+
+    done = true;
+    audio_thread.join();
+    poll_thread.join();
+
+    for (const Capture & c : take_captures()) {
+        check_capture_invariants(c);
+        checked++;
+    }
+
+    if (audio_is_capturing()) {
+        fail("still capturing after the final end request drained");
+    }
+    if (checked > end_requests) {
+        fail(std::to_string(checked) + " captures from only " + std::to_string(end_requests) + " end requests");
+    }
+
+    std::cerr << "concurrent: " << checked << " captures checked, "
+        << clock.now() << " samples fed" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <deterministic|concurrent> [seed] [iterations]" << std::endl;
+        return 2;
+    }
+
+    std::string mode = argv[1];
+    uint64_t seed = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1;
+    int iterations = argc > 3 ? std::atoi(argv[3]) : 20000;
+
+    // audioproc logs every capture; keep the output readable.
+    std::cout.setstate(std::ios::failbit);
+
+    if (mode == "deterministic") {
+        run_deterministic(seed, iterations);
+    } else if (mode == "concurrent") {
+        run_concurrent(seed, iterations);
+    } else {
+        std::cerr << "Unknown mode: " << mode << std::endl;
+        return 2;
+    }
+
+    if (failures > 0) {
+        std::cerr << failures << " failures" << std::endl;
+        return 1;
+    }
+    return 0;
+}
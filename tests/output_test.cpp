@@ -0,0 +1,327 @@
+/*
+    output_test.cpp
+
+    Exercises capture output without SDL: durable_write batches, the output
+    queue's flush-on-stop and retry paths, and reading captures back through
+    mapped_wav. Each scenario runs in its own
+    process, inside a fresh temp directory.
+
+    Usage: output_test <scenario>
+*/
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "config.h"
+#include "durable_write.h"
+#include "mapped_wav.h"
+#include "output_queue.h"
+#include "wavfile.h"
+
+namespace fs = std::filesystem;
+
+int failures = 0;
+
+void check(bool ok, const std::string & msg) {
+    if (!ok) {
+        std::cerr << "FAIL: " << msg << std::endl;
+        failures++;
+    }
+}
+
+std::vector<int16_t> ramp(size_t sample_count, int16_t first) {
+    std::vector<int16_t> samples(sample_count);
+    for (size_t i = 0; i < sample_count; i++) {
+        samples[i] = static_cast<int16_t>(first + i);
+    }
+    return samples;
+}
+
+size_t count_temp_files(const fs::path & directory) {
+    size_t count = 0;
+    if (!fs::exists(directory)) {
+        return 0;
+    }
+    for (const auto & entry : fs::directory_iterator(directory)) {
+        if (entry.path().extension() == ".tmp") {
+            count++;
+        }
+    }
+    return count;
+}
+
+void check_wav(const std::string & filename, const std::vector<int16_t> & expected) {
+    std::vector<int16_t> samples;
+    int sample_rate = 0;
+    check(read_wav(filename, samples, sample_rate), filename + " unreadable");
+    check(sample_rate == SAMPLE_RATE, filename + " has the wrong sample rate");
+    check(samples == expected, filename + " has the wrong samples");
+}
+
+// A batch lands under its final names, intact, with no temp files left.
+void scenario_durable_batch() {
+    fs::create_directory("out");
+
+    std::vector<std::vector<int16_t>> clips = {ramp(0, 0), ramp(10, 100), ramp(SAMPLE_RATE * 3, -5000)};
+    std::vector<DurableWrite> batch;
+    for (size_t i = 0; i < clips.size(); i++) {
+        std::string error;
+        std::optional<DurableWrite> write = durable_write_begin(
+            clips[i].data(), clips[i].size(), SAMPLE_RATE, "out/clip" + std::to_string(i) + ".wav", error);
+        check(write.has_value(), "begin failed: " + error);
+        if (write) {
+            check(!fs::exists(write->filename), "final name visible before commit");
+            check(fs::exists(write->temp_filename), "temp file missing before commit");
+            batch.push_back(*write);
+        }
+    }
+
+    std::vector<std::string> errors = durable_write_commit(batch);
+    check(errors.size() == batch.size(), "one result per write");
+    for (size_t i = 0; i < errors.size(); i++) {
+        check(errors[i].empty(), "commit failed: " + errors[i]);
+        check(batch[i].renamed, "renamed not set after commit");
+        check_wav("out/clip" + std::to_string(i) + ".wav", clips[i]);
+    }
+    check(count_temp_files("out") == 0, "temp files left after commit");
+
+    std::string error;
+    check(durable_write_sync_directory("out/clip0.wav", error), "directory sync failed: " + error);
+}
+
+// Writing into a directory that doesn't exist fails with an error and
+// leaves nothing behind.
+void scenario_durable_missing_dir() {
+    std::vector<int16_t> clip = ramp(100, 0);
+    std::string error;
+    std::optional<DurableWrite> write = durable_write_begin(
+        clip.data(), clip.size(), SAMPLE_RATE, "missing/clip.wav", error);
+    check(!write, "begin succeeded into a missing directory");
+    check(!error.empty(), "no error reported");
+    check(!fs::exists("missing"), "directory appeared");
+
+    error.clear();
+    check(!durable_write_sync_directory("missing/clip.wav", error), "synced a missing directory");
+    check(!error.empty(), "no directory sync error reported");
+}
+
+// Stopping the queue straight after pushing writes everything out without
+// waiting for the sync window, and stale temp files are cleared on start.
+void scenario_queue_flush() {
+    fs::create_directory(CAPTURE_DIRECTORY);
+    std::string stale = std::string(CAPTURE_DIRECTORY) + "/crashed.wav.tmp";
+    fclose(fopen(stale.c_str(), "w"));
+
+    output_queue_start_thread();
+
+    std::vector<int16_t> clip = ramp(SAMPLE_RATE, 7);
+    for (int i = 0; i < 3; i++) {
+        output_queue_push(clip.data(), clip.size(), SAMPLE_RATE);
+    }
+    output_queue_stop();
+
+    check(!fs::exists(stale), "stale temp file not removed");
+    check(count_temp_files(CAPTURE_DIRECTORY) == 0, "temp files left after stop");
+    check(output_queue_take_failed().empty(), "captures failed");
+
+    std::vector<std::string> finished = output_queue_take_finished();
+    check(finished.size() == 3, std::to_string(finished.size()) + " captures finished, expected 3");
+    for (const std::string & filename : finished) {
+        check_wav(filename, clip);
+    }
+}
+
+// With no capture directory, a job is retried with backoff and given up on
+// after OUTPUT_MAX_ATTEMPTS, without bringing anything down.
+void scenario_queue_retry() {
+    output_queue_start_thread();
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int16_t> clip = ramp(100, 0);
+    output_queue_push(clip.data(), clip.size(), SAMPLE_RATE);
+
+    int backoff_ms = 0;
+    for (int attempt = 1; attempt < OUTPUT_MAX_ATTEMPTS; attempt++) {
+        backoff_ms += OUTPUT_RETRY_BACKOFF_MS * attempt;
+    }
+
+    std::vector<std::string> failed;
+    auto deadline = start + std::chrono::milliseconds(backoff_ms + 5000);
+    while (failed.empty() && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        failed = output_queue_take_failed();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    check(failed.size() == 1, "job never reached FAILED");
+    check(elapsed >= std::chrono::milliseconds(backoff_ms), "gave up before all retries were spent");
+    check(output_queue_take_finished().empty(), "failed job reported as finished");
+
+    output_queue_stop();
+    check(!fs::exists(CAPTURE_DIRECTORY), "capture directory appeared");
+}
+
+// Writes a clip the way the output queue does.
+void write_clip(const std::string & filename, const std::vector<int16_t> & samples) {
+    std::string error;
+    std::optional<DurableWrite> write = durable_write_begin(samples.data(), samples.size(), SAMPLE_RATE, filename, error);
+    check(write.has_value(), "begin failed: " + error);
+    if (!write) {
+        return;
+    }
+    std::vector<DurableWrite> batch = {*write};
+    check(durable_write_commit(batch).front().empty(), "commit failed for " + filename);
+}
+
+// The mapping reads back exactly what was written, and the peaks are the
+// min/max of each column's slice.
+void scenario_mapped_read() {
+    std::vector<int16_t> clip = ramp(SAMPLE_RATE, -20000);
+    write_clip("clip.wav", clip);
+
+    std::string error;
+    std::optional<MappedWav> wav = mapped_wav_open("clip.wav", error);
+    check(wav.has_value(), "open failed: " + error);
+    if (!wav) {
+        return;
+    }
+
+    check(wav->sample_rate == SAMPLE_RATE, "wrong sample rate");
+    check(std::vector<int16_t>(wav->samples, wav->samples + wav->sample_count) == clip, "samples differ");
+
+    std::vector<WavPeak> peaks = mapped_wav_peaks(*wav, WINDOW_WIDTH);
+    check(peaks.size() == WINDOW_WIDTH, "wrong number of peaks");
+    for (int x = 0; x < WINDOW_WIDTH; x++) {
+        // A ramp's min and max are the ends of each column's slice.
+        size_t begin = x * clip.size() / WINDOW_WIDTH;
+        size_t end = (x + 1) * clip.size() / WINDOW_WIDTH;
+        if (peaks[x].min != clip[begin] || peaks[x].max != clip[end - 1]) {
+            check(false, "peak " + std::to_string(x) + " wrong");
+            break;
+        }
+    }
+
+    // Fewer samples than columns: each column shows the sample under it.
+    std::vector<int16_t> tiny = {100, -200, 300};
+    write_clip("tiny.wav", tiny);
+    std::optional<MappedWav> tiny_wav = mapped_wav_open("tiny.wav", error);
+    check(tiny_wav.has_value(), "open failed: " + error);
+    if (tiny_wav) {
+        std::vector<WavPeak> tiny_peaks = mapped_wav_peaks(*tiny_wav, 6);
+        for (int x = 0; x < 6; x++) {
+            int16_t expected = tiny[x * tiny.size() / 6];
+            check(tiny_peaks[x].min == expected && tiny_peaks[x].max == expected,
+                "tiny peak " + std::to_string(x) + " wrong");
+        }
+        mapped_wav_close(*tiny_wav);
+    }
+
+    mapped_wav_close(*wav);
+    check(wav->samples == nullptr && wav->sample_count == 0, "close left samples behind");
+}
+
+// A zero-sample clip maps fine, and its peaks are flat.
+void scenario_mapped_empty() {
+    write_clip("empty.wav", {});
+
+    std::string error;
+    std::optional<MappedWav> wav = mapped_wav_open("empty.wav", error);
+    check(wav.has_value(), "open failed: " + error);
+    if (!wav) {
+        return;
+    }
+
+    check(wav->sample_count == 0, "empty clip has samples");
+    std::vector<WavPeak> peaks = mapped_wav_peaks(*wav, WINDOW_WIDTH);
+    check(peaks.size() == WINDOW_WIDTH, "wrong number of peaks");
+    for (const WavPeak & peak : peaks) {
+        check(peak.min == 0 && peak.max == 0, "empty clip has a non-flat peak");
+    }
+    mapped_wav_close(*wav);
+}
+
+// A file cut short of what its header claims is read up to where it ends,
+// and files that aren't a usable .wav are refused.
+void scenario_mapped_short() {
+    std::vector<int16_t> clip = ramp(1000, 0);
+    write_clip("short.wav", clip);
+
+    // Lose the last 100 samples and half of the one before.
+    fs::resize_file("short.wav", sizeof(WAVHeader) + 899 * sizeof(int16_t) + 1);
+
+    std::string error;
+    std::optional<MappedWav> wav = mapped_wav_open("short.wav", error);
+    check(wav.has_value(), "open failed: " + error);
+    if (wav) {
+        check(wav->sample_count == 899, "short clip has " + std::to_string(wav->sample_count) + " samples");
+        check(std::vector<int16_t>(wav->samples, wav->samples + wav->sample_count)
+            == std::vector<int16_t>(clip.begin(), clip.begin() + 899), "short clip samples differ");
+        mapped_wav_peaks(*wav, WINDOW_WIDTH);
+        mapped_wav_close(*wav);
+    }
+
+    fs::resize_file("short.wav", sizeof(WAVHeader) - 1);
+    check(!mapped_wav_open("short.wav", error), "opened a file shorter than a header");
+
+    write_clip("notwav.wav", clip);
+    {
+        FILE * f = fopen("notwav.wav", "r+b");
+        fwrite("RIFX", 1, 4, f);
+        fclose(f);
+    }
+    check(!mapped_wav_open("notwav.wav", error), "opened a file with a bad header");
+
+    check(!mapped_wav_open("absent.wav", error), "opened a file that doesn't exist");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <scenario>" << std::endl;
+        return 2;
+    }
+
+    std::string scenario = argv[1];
+    std::string dir_template = (fs::temp_directory_path() / "laststop-output-XXXXXX").string();
+    if (!mkdtemp(dir_template.data()) || chdir(dir_template.c_str()) != 0) {
+        std::cerr << "Unable to make a temp directory" << std::endl;
+        return 2;
+    }
+
+    // Progress logging; keep the output readable.
+    std::cout.setstate(std::ios::failbit);
+
+    if (scenario == "durable_batch") {
+        scenario_durable_batch();
+    } else if (scenario == "durable_missing_dir") {
+        scenario_durable_missing_dir();
+    } else if (scenario == "queue_flush") {
+        scenario_queue_flush();
+    } else if (scenario == "queue_retry") {
+        scenario_queue_retry();
+    } else if (scenario == "mapped_read") {
+        scenario_mapped_read();
+    } else if (scenario == "mapped_empty") {
+        scenario_mapped_empty();
+    } else if (scenario == "mapped_short") {
+        scenario_mapped_short();
+    } else {
+        std::cerr << "Unknown scenario: " << scenario << std::endl;
+        return 2;
+    }
+
+    fs::remove_all(dir_template);
+
+    if (failures > 0) {
+        std::cerr << failures << " failures" << std::endl;
+        return 1;
+    }
+    return 0;
+}
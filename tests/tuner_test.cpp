@@ -0,0 +1,262 @@
+/*
+    tuner_test.cpp
+
+    Drives the tuner with synthetic callback timing and synthetic loopback
+    recordings, and checks the buffer sizes, latency and pad it picks. The
+    tuner keeps global state, so each scenario runs in its own process.
+
+    Usage: tuner_test <scenario>
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "tuner.h"
+
+int failures = 0;
+
+void check(bool ok, const std::string & msg) {
+    if (!ok) {
+        std::cerr << "FAIL: " << msg << std::endl;
+        failures++;
+    }
+}
+
+// Stands in for the SDL capture device. Reopens whenever the tuner asks,
+// and records every buffer size it was opened with.
+struct SimulatedDevice {
+    // The buffer size the device actually gives for a requested one.
+    std::function<int(int)> obtained_size = [](int requested) { return requested; };
+    int sample_rate = SAMPLE_RATE;
+    int buffer_size = BUFFER_SIZE;
+    double now = 0.0;
+    size_t callbacks_since_open = 0;
+    std::vector<int> opened_sizes;
+    std::vector<size_t> callbacks_before_reopen;
+    std::vector<int16_t> silence = std::vector<int16_t>(8192, 0);
+
+    void open(int requested) {
+        buffer_size = obtained_size(requested);
+        opened_sizes.push_back(buffer_size);
+        callbacks_since_open = 0;
+        tuner_device_opened(buffer_size, sample_rate);
+    }
+
+    // `interval` gives the time since the previous callback, from the buffer
+    // size and the callback's index since the device was opened.
+    void run(size_t callbacks, const std::function<double(int, size_t)> & interval) {
+        for (size_t i = 0; i < callbacks; i++) {
+            now += interval(buffer_size, callbacks_since_open);
+            tuner_callback_tick(now, silence.data(), buffer_size);
+            callbacks_since_open++;
+
+            if (tuner_take_reopen_request()) {
+                callbacks_before_reopen.push_back(callbacks_since_open);
+                open(tuner_buffer_size());
+            }
+        }
+    }
+};
+
+double period(int buffer_size) {
+    return static_cast<double>(buffer_size) / SAMPLE_RATE;
+}
+
+// Callbacks from opening the device to the end of its first window.
+constexpr size_t FIRST_WINDOW = 1 + TUNER_WARMUP_CALLBACKS + TUNER_WINDOW_CALLBACKS;
+
+std::string sizes_string(const std::vector<int> & sizes) {
+    std::string s;
+    for (int size : sizes) {
+        s += std::to_string(size) + " ";
+    }
+    return s;
+}
+
+// Perfect timing at every size walks all the way down and stays there.
+void scenario_step_down() {
+    SimulatedDevice device;
+    device.open(tuner_buffer_size());
+    device.run(20 * FIRST_WINDOW, [](int size, size_t) { return period(size); });
+
+    std::vector<int> expected = {1536, 1024, 512, 256};
+    check(device.opened_sizes == expected, "step down went " + sizes_string(device.opened_sizes));
+}
+
+// Sizes of 512 and below are too jittery. The tuner settles at 1024, and
+// only probes 512 again after TUNER_REPROBE_WINDOWS stable windows.
+void scenario_unstable_floor() {
+    SimulatedDevice device;
+    device.open(tuner_buffer_size());
+
+    auto interval = [](int size, size_t i) {
+        if (size <= 512) {
+            return period(size) * ((i % 2) ? 1.5 : 0.5);
+        }
+        return period(size);
+    };
+
+    size_t settle = 3 * FIRST_WINDOW + (TUNER_UNSTABLE_WINDOWS - 1) * TUNER_WINDOW_CALLBACKS;
+    device.run(settle, interval);
+    std::vector<int> expected = {1536, 1024, 512, 1024};
+    check(device.opened_sizes == expected, "settling went " + sizes_string(device.opened_sizes));
+
+    device.run((TUNER_REPROBE_WINDOWS + TUNER_UNSTABLE_WINDOWS + 2) * TUNER_WINDOW_CALLBACKS, interval);
+    expected = {1536, 1024, 512, 1024, 512, 1024};
+    check(device.opened_sizes == expected, "reprobe went " + sizes_string(device.opened_sizes));
+
+    // The reprobe came from the 1024 opened at index 3.
+    size_t stable_stretch = device.callbacks_before_reopen[3];
+    check(stable_stretch == FIRST_WINDOW + (TUNER_REPROBE_WINDOWS - 1) * TUNER_WINDOW_CALLBACKS,
+        "reprobed after " + std::to_string(stable_stretch) + " callbacks");
+}
+
+// An occasional late callback doesn't stop the walk down; a late callback
+// in every window steps back up, but only after TUNER_UNSTABLE_WINDOWS.
+void scenario_glitch() {
+    SimulatedDevice device;
+    device.open(tuner_buffer_size());
+
+    // Every other window has one late callback.
+    device.run(20 * FIRST_WINDOW, [](int size, size_t i) {
+        return (i % (2 * TUNER_WINDOW_CALLBACKS) == 100) ? 3.0 * period(size) : period(size);
+    });
+    std::vector<int> expected = {1536, 1024, 512, 256};
+    check(device.opened_sizes == expected, "occasional glitches went " + sizes_string(device.opened_sizes));
+
+    auto every_window = [](int size, size_t i) {
+        return (i % TUNER_WINDOW_CALLBACKS == 50) ? 3.0 * period(size) : period(size);
+    };
+
+    device.run((TUNER_UNSTABLE_WINDOWS - 1) * TUNER_WINDOW_CALLBACKS, every_window);
+    check(device.opened_sizes == expected, "stepped up before TUNER_UNSTABLE_WINDOWS");
+
+    device.run(2 * TUNER_WINDOW_CALLBACKS, every_window);
+    expected.push_back(512);
+    check(device.opened_sizes == expected, "sustained glitches went " + sizes_string(device.opened_sizes));
+}
+
+// A device that ignores the requested size is asked once, then left alone.
+void scenario_ignored() {
+    SimulatedDevice device;
+    device.obtained_size = [](int) { return 1536; };
+    device.open(tuner_buffer_size());
+    device.run(FIRST_WINDOW + 2 * TUNER_REPROBE_WINDOWS * TUNER_WINDOW_CALLBACKS,
+        [](int size, size_t) { return period(size); });
+
+    std::vector<int> expected = {1536, 1536};
+    check(device.opened_sizes == expected, "ignored device went " + sizes_string(device.opened_sizes));
+}
+
+// A device that rounds to multiples of 480 (10 ms at 48 kHz), with 480 as
+// its floor. The tuner steps from whatever it got, including a first open
+// that isn't the size it asked for, and stops once it can't go lower.
+void scenario_rounding() {
+    SimulatedDevice device;
+    device.obtained_size = [](int requested) {
+        return std::max(480, (requested + 240) / 480 * 480);
+    };
+    device.open(tuner_buffer_size());
+    device.run(10 * FIRST_WINDOW + 2 * TUNER_REPROBE_WINDOWS * TUNER_WINDOW_CALLBACKS,
+        [](int size, size_t) { return period(size); });
+
+    std::vector<int> expected = {1440, 960, 480, 480};
+    check(device.opened_sizes == expected, "rounding device went " + sizes_string(device.opened_sizes));
+}
+
+std::vector<int16_t> recording_with_click(int16_t noise, int16_t click, size_t click_at) {
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> dist(-noise, noise);
+    std::vector<int16_t> samples(SAMPLE_RATE / 2);
+    for (auto & s : samples) {
+        s = static_cast<int16_t>(dist(rng));
+    }
+    for (size_t i = click_at; i < click_at + 40 && i < samples.size(); i++) {
+        samples[i] = click;
+    }
+    return samples;
+}
+
+// Latency comes from where the click starts; the pad follows the formula in
+// tuner_latency_pad().
+void scenario_calibration() {
+    SimulatedDevice device;
+    device.obtained_size = [](int) { return BUFFER_SIZE; };
+    device.open(tuner_buffer_size());
+    device.run(FIRST_WINDOW, [](int size, size_t) { return period(size); });
+
+    check(!tuner_measured_latency(), "latency measured before calibrating");
+    check(tuner_latency_pad() == SAMPLE_QUEUE_LATENCY, "pad should default to SAMPLE_QUEUE_LATENCY");
+
+    // Quiet room: just has to clear CALIBRATION_CLICK_THRESHOLD.
+    std::optional<double> latency = tuner_calibrate_from_recording(recording_with_click(0, 9000, 1000), SAMPLE_RATE);
+    check(latency && std::abs(*latency - 1000.0 / SAMPLE_RATE) < 1e-9, "quiet recording latency");
+
+    // Noisy room: a click under CALIBRATION_NOISE_RATIO times the noise is ignored...
+    latency = tuner_calibrate_from_recording(recording_with_click(3000, 10000, 2205), SAMPLE_RATE);
+    check(!latency, "click buried in noise was detected");
+
+    // ...and one over it is found.
+    latency = tuner_calibrate_from_recording(recording_with_click(3000, 20000, 2205), SAMPLE_RATE);
+    check(latency && std::abs(*latency - 0.05) < 1e-9, "noisy recording latency");
+
+    double pad_seconds = 0.05 + period(BUFFER_SIZE) + TUNER_PAD_MARGIN_SECONDS;
+    size_t expected_pad = static_cast<size_t>(std::ceil(pad_seconds * SAMPLE_RATE * CHANNELS));
+    check(tuner_latency_pad() == expected_pad,
+        "pad " + std::to_string(tuner_latency_pad()) + " != " + std::to_string(expected_pad));
+    check(tuner_latency_pad() < SAMPLE_QUEUE_LATENCY, "calibrated pad should beat the default");
+
+    // The pad is counted in samples at the device's real rate, not SAMPLE_RATE.
+    SimulatedDevice fast_device;
+    fast_device.sample_rate = 48000;
+    fast_device.obtained_size = [](int) { return BUFFER_SIZE; };
+    fast_device.open(BUFFER_SIZE);
+    fast_device.run(FIRST_WINDOW, [](int size, size_t) { return static_cast<double>(size) / 48000; });
+
+    pad_seconds = 0.05 + static_cast<double>(BUFFER_SIZE) / 48000 + TUNER_PAD_MARGIN_SECONDS;
+    expected_pad = static_cast<size_t>(std::ceil(pad_seconds * 48000 * CHANNELS));
+    // Lands on a whole sample, so allow for the ceil of a hair of jitter.
+    check(tuner_latency_pad() - expected_pad <= 1,
+        "48 kHz pad " + std::to_string(tuner_latency_pad()) + " != " + std::to_string(expected_pad));
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <scenario>" << std::endl;
+        return 2;
+    }
+
+    // The tuner logs its decisions; keep the output readable.
+    std::cout.setstate(std::ios::failbit);
+
+    std::string scenario = argv[1];
+    if (scenario == "step_down") {
+        scenario_step_down();
+    } else if (scenario == "unstable_floor") {
+        scenario_unstable_floor();
+    } else if (scenario == "glitch") {
+        scenario_glitch();
+    } else if (scenario == "ignored") {
+        scenario_ignored();
+    } else if (scenario == "rounding") {
+        scenario_rounding();
+    } else if (scenario == "calibration") {
+        scenario_calibration();
+    } else {
+        std::cerr << "Unknown scenario: " << scenario << std::endl;
+        return 2;
+    }
+
+    if (failures > 0) {
+        std::cerr << failures << " failures" << std::endl;
+        return 1;
+    }
+    return 0;
+}